@@ -0,0 +1,436 @@
+// Cycle counting benchmark for the MC2 firmware running under simavr
+// Loads a BENCHMARK=1 build (see the bench_* envs in platformio.ini), feeds it
+// scripted ADC and pin stimuli and times the stage markers the firmware writes
+// to GPIOR0.  Prints one JSON object per run on stdout.
+//------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "avr_adc.h"
+#include "avr_ioport.h"
+#include "avr_eeprom.h"
+
+#define F_CPU 16000000
+#define VCC_MV 5000
+#define GPIOR0_ADDR 0x3E // _SFR_IO8(0x1E) in data space
+
+// must match BENCH_* in src/main.cpp
+#define MARK_LOOP_START 1
+#define MARK_LOOP_END  11
+#define NUM_MARKS      12
+
+static const char *stage_names[NUM_MARKS] = {
+  NULL, NULL,
+  "accel",      // BENCH_ACCEL
+  "brake",      // BENCH_BRAKE
+  "wheel_adc",  // BENCH_WHEEL_ADC
+  "cosine",     // BENCH_COSINE
+  "wheel_avg",  // BENCH_WHEEL_AVG
+  "axes",       // BENCH_AXES
+  "buttons",    // BENCH_BUTTONS
+  "dpad",       // BENCH_DPAD
+  "send",       // BENCH_SEND
+  "serial",     // BENCH_LOOP_END
+};
+
+// Pro Micro wiring, see the pin table at the top of src/main.cpp
+#define ADC_WHEEL    4 // A3
+#define ADC_BRAKE    5 // A2
+#define ADC_ACCEL    6 // A1
+#define ADC_TRIANGLE 7 // A0
+#define ADC_CROSS    8 // A6/D4
+#define ADC_SQUARE  10 // A7/D6
+#define ANALOG_BUTTON_OPEN_MV 1480
+
+static const struct { char port; int bit; } digital_buttons[] = {
+  {'D',2}, {'D',3}, {'D',1}, {'D',0}, // D0 D1 D2 D3 paddles
+  {'C',6}, {'E',6}, {'B',4}, {'B',5}, // D5 D7 D8 D9 shift down, DPAD
+  {'B',6}, {'B',3}, {'B',1}, {'B',2}, // D10 D14 D15 D16 circle, start, DUP, shift up
+};
+
+#define MAX_TOKENS 16
+
+struct pin_token
+{
+  int is_adc;   // 1 = ADCn=mV, 0 = P<port><bit>=level
+  char port;
+  int index;
+  uint32_t value;
+};
+
+struct step
+{
+  int loops;
+  uint32_t wheel_mv, accel_mv, brake_mv;
+  int num_tokens;
+  struct pin_token tokens[MAX_TOKENS];
+};
+
+struct stats
+{
+  uint64_t min, max, total, count;
+};
+
+struct bench
+{
+  avr_t *avr;
+  struct step *steps;
+  int num_steps;
+  int warmup, loops;
+  int loop_index;     // number of LOOP_START markers seen
+  int loops_done;     // measured loops that reached LOOP_END
+  int out_of_order;
+  uint8_t last_mark;
+  avr_cycle_count_t last_cycle, loop_start_cycle;
+  struct stats stage[NUM_MARKS];
+  struct stats loop;
+};
+
+static void stats_add(struct stats *s, uint64_t v)
+{
+  if(s->count == 0 || v < s->min) s->min = v;
+  if(v > s->max) s->max = v;
+  s->total += v;
+  s->count++;
+}
+
+static void set_adc(avr_t *avr, int channel, uint32_t mv)
+{
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 + channel), mv);
+}
+
+static void set_pin(avr_t *avr, char port, int bit, int level)
+{
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), bit), level);
+}
+
+// Apply the stimulus for the loop about to run.  Pin and ADC tokens are
+// applied when their step starts and hold until a later step changes them.
+static void apply_stimulus(struct bench *b, int loop)
+{
+  int total = 0;
+  for(int s = 0; s < b->num_steps; s++)
+  {
+    struct step *st = &b->steps[s];
+    if(loop < total + st->loops)
+    {
+      set_adc(b->avr, ADC_WHEEL, st->wheel_mv);
+      set_adc(b->avr, ADC_ACCEL, st->accel_mv);
+      set_adc(b->avr, ADC_BRAKE, st->brake_mv);
+      if(loop == total)
+      {
+        for(int t = 0; t < st->num_tokens; t++)
+        {
+          struct pin_token *tok = &st->tokens[t];
+          if(tok->is_adc)
+            set_adc(b->avr, tok->index, tok->value);
+          else
+            set_pin(b->avr, tok->port, tok->index, tok->value);
+        }
+      }
+      return;
+    }
+    total += st->loops;
+  }
+  // past the end of the script: start over
+  if(total > 0)
+    apply_stimulus(b, loop % total);
+}
+
+static void mark_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+  struct bench *b = (struct bench *)param;
+  avr_cycle_count_t now = avr->cycle;
+
+  avr->data[addr] = v;
+  if(v == 0 || v >= NUM_MARKS)
+    return;
+
+  if(v == MARK_LOOP_START)
+  {
+    // a new loop may only follow the end of the previous one (or reset)
+    if(b->last_mark != 0 && b->last_mark != MARK_LOOP_END)
+      b->out_of_order++;
+    apply_stimulus(b, b->loop_index);
+    b->loop_index++;
+    b->loop_start_cycle = now;
+  }
+  else
+  {
+    if(v != b->last_mark + 1)
+      b->out_of_order++;
+    if(b->loop_index > b->warmup)
+    {
+      stats_add(&b->stage[v], now - b->last_cycle);
+      if(v == MARK_LOOP_END)
+      {
+        stats_add(&b->loop, now - b->loop_start_cycle);
+        b->loops_done++;
+      }
+    }
+  }
+  b->last_mark = v;
+  b->last_cycle = now;
+}
+
+// Mirrors the start of struct caltype in src/main.cpp: ten 16 bit ints followed
+// by a bool, written to profile 0. The name and the other profiles stay blank
+// and fall back to their defaults.
+static void load_cal(avr_t *avr, int cosine, int samples, int scale_angle)
+{
+  int16_t v[10] = {0, 995, 496, 50, 0, 758, 0, 780, 0, 0};
+  uint8_t ee[21];
+  avr_eeprom_desc_t desc;
+
+  v[8] = scale_angle;
+  v[9] = samples;
+  for(int i = 0; i < 10; i++)
+  {
+    ee[2*i] = v[i] & 0xFF;
+    ee[2*i+1] = (v[i] >> 8) & 0xFF;
+  }
+  ee[20] = cosine;
+
+  desc.ee = ee;
+  desc.offset = 0;
+  desc.size = sizeof(ee);
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &desc);
+}
+
+static int parse_token(const char *s, struct pin_token *tok)
+{
+  char port;
+  int index;
+  unsigned value;
+
+  if(sscanf(s, "ADC%d=%u", &index, &value) == 2 && index >= 0 && index < 16)
+  {
+    tok->is_adc = 1;
+    tok->index = index;
+    tok->value = value;
+    return 0;
+  }
+  if(sscanf(s, "P%c%d=%u", &port, &index, &value) == 3 && isupper((unsigned char)port)
+     && index >= 0 && index < 8 && value <= 1)
+  {
+    tok->is_adc = 0;
+    tok->port = port;
+    tok->index = index;
+    tok->value = value;
+    return 0;
+  }
+  return -1;
+}
+
+// Script format, one step per line ('#' starts a comment):
+//   <loops> <wheel mV> <accel mV> <brake mV> [PB3=0] [ADC8=800] ...
+static int load_script(const char *path, struct bench *b)
+{
+  FILE *f = fopen(path, "r");
+  char line[512];
+  int lineno = 0;
+
+  if(!f)
+  {
+    perror(path);
+    return -1;
+  }
+  while(fgets(line, sizeof(line), f))
+  {
+    struct step st;
+    char *tok, *save;
+    int field = 0;
+
+    lineno++;
+    memset(&st, 0, sizeof(st));
+    if((tok = strchr(line, '#')) != NULL)
+      *tok = '\0';
+    for(tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save), field++)
+    {
+      switch(field)
+      {
+        case 0: st.loops = atoi(tok); break;
+        case 1: st.wheel_mv = strtoul(tok, NULL, 10); break;
+        case 2: st.accel_mv = strtoul(tok, NULL, 10); break;
+        case 3: st.brake_mv = strtoul(tok, NULL, 10); break;
+        default:
+          if(st.num_tokens >= MAX_TOKENS || parse_token(tok, &st.tokens[st.num_tokens++]))
+          {
+            fprintf(stderr, "%s:%d: bad token '%s'\n", path, lineno, tok);
+            fclose(f);
+            return -1;
+          }
+      }
+    }
+    if(field == 0)
+      continue;
+    if(field < 4 || st.loops < 1)
+    {
+      fprintf(stderr, "%s:%d: expected <loops> <wheel> <accel> <brake>\n", path, lineno);
+      fclose(f);
+      return -1;
+    }
+    b->steps = realloc(b->steps, (b->num_steps + 1) * sizeof(*b->steps));
+    b->steps[b->num_steps++] = st;
+  }
+  fclose(f);
+  return b->num_steps ? 0 : -1;
+}
+
+// Default stimulus: wheel, accelerator and brake ramp 0-5V in 100mV steps
+static void default_script(struct bench *b)
+{
+  b->num_steps = 51;
+  b->steps = calloc(b->num_steps, sizeof(*b->steps));
+  for(int i = 0; i < b->num_steps; i++)
+  {
+    b->steps[i].loops = 1;
+    b->steps[i].wheel_mv = i * 100;
+    b->steps[i].accel_mv = i * 100;
+    b->steps[i].brake_mv = (b->num_steps - 1 - i) * 100;
+  }
+}
+
+static void print_stats(const char *name, const struct stats *s)
+{
+  printf("\"%s\":{\"min\":%llu,\"avg\":%.1f,\"max\":%llu}", name,
+         (unsigned long long)s->min,
+         s->count ? (double)s->total / s->count : 0.0,
+         (unsigned long long)s->max);
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "usage: %s -f firmware.elf [-t label] [-c 0|1] [-n samples] [-a angle]\n"
+    "          [-l loops] [-w warmup] [-s script]\n"
+    "  -c  cosine_scaling_enable written to EEPROM (default 1)\n"
+    "  -n  steering_num_samples written to EEPROM, 1-100 (default 10)\n"
+    "  -a  scale_angle written to EEPROM, 45-90 (default 90)\n"
+    "  -l  number of measured loops (default 200)\n"
+    "  -w  loops to run before measuring (default 2)\n"
+    "  -s  stimulus script, see bench/stimulus/example.txt\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *elf = NULL, *label = "", *script = NULL;
+  int cosine = 1, samples = 10, scale_angle = 90;
+  struct bench b;
+  elf_firmware_t fw;
+  avr_cycle_count_t max_cycles;
+  int opt, state;
+
+  memset(&b, 0, sizeof(b));
+  b.loops = 200;
+  b.warmup = 2;
+
+  while((opt = getopt(argc, argv, "f:t:c:n:a:l:w:s:h")) != -1)
+  {
+    switch(opt)
+    {
+      case 'f': elf = optarg; break;
+      case 't': label = optarg; break;
+      case 'c': cosine = atoi(optarg); break;
+      case 'n': samples = atoi(optarg); break;
+      case 'a': scale_angle = atoi(optarg); break;
+      case 'l': b.loops = atoi(optarg); break;
+      case 'w': b.warmup = atoi(optarg); break;
+      case 's': script = optarg; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(!elf || (cosine != 0 && cosine != 1) || samples < 1 || samples > 100 || scale_angle < 45 || scale_angle > 90
+     || b.loops < 1 || b.warmup < 0)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if(script ? load_script(script, &b) : (default_script(&b), 0))
+    return 1;
+
+  memset(&fw, 0, sizeof(fw));
+  if(elf_read_firmware(elf, &fw))
+  {
+    fprintf(stderr, "%s: unable to load firmware\n", elf);
+    return 1;
+  }
+  b.avr = avr_make_mcu_by_name("atmega32u4");
+  if(!b.avr)
+  {
+    fprintf(stderr, "simavr has no atmega32u4 core\n");
+    return 1;
+  }
+  avr_init(b.avr);
+  b.avr->frequency = F_CPU;
+  b.avr->vcc = b.avr->avcc = b.avr->aref = VCC_MV;
+  b.avr->log = LOG_ERROR;
+  fw.frequency = F_CPU;
+  avr_load_firmware(b.avr, &fw);
+
+  // idle inputs: buttons released, analog buttons open
+  for(size_t i = 0; i < sizeof(digital_buttons)/sizeof(digital_buttons[0]); i++)
+    set_pin(b.avr, digital_buttons[i].port, digital_buttons[i].bit, 1);
+  set_adc(b.avr, ADC_TRIANGLE, ANALOG_BUTTON_OPEN_MV);
+  set_adc(b.avr, ADC_CROSS, ANALOG_BUTTON_OPEN_MV);
+  set_adc(b.avr, ADC_SQUARE, ANALOG_BUTTON_OPEN_MV);
+
+  load_cal(b.avr, cosine, samples, scale_angle);
+  avr_register_io_write(b.avr, GPIOR0_ADDR, mark_write, &b);
+
+  // each loop ends in delay(50), so one simulated second per loop is plenty
+  max_cycles = (avr_cycle_count_t)(b.warmup + b.loops + 5) * F_CPU;
+  do
+  {
+    state = avr_run(b.avr);
+    if(b.avr->cycle > max_cycles)
+    {
+      // say where it stuck: before loop() means setup() or the USB core startup
+      if(b.loop_index == 0)
+        fprintf(stderr, "timeout before the first loop, PC 0x%05x. Not a BENCHMARK=1 build,"
+                " or stuck in setup()/USBDevice.attach()\n", (unsigned)b.avr->pc);
+      else
+        fprintf(stderr, "timeout in loop %d after marker %d, PC 0x%05x\n",
+                b.loop_index, b.last_mark, (unsigned)b.avr->pc);
+      return 1;
+    }
+  } while(state != cpu_Done && state != cpu_Crashed && b.loops_done < b.loops);
+
+  if(b.loops_done < b.loops)
+  {
+    fprintf(stderr, "simulation stopped (state %d) after %d loops\n", state, b.loop_index);
+    return 1;
+  }
+
+  // markers skipped or repeated means the stage numbers can't be trusted
+  if(b.out_of_order)
+  {
+    fprintf(stderr, "%d stage markers arrived out of order\n", b.out_of_order);
+    return 1;
+  }
+
+  printf("{\"label\":\"%s\",\"cosine\":%d,\"samples\":%d,\"scale_angle\":%d,"
+         "\"loops\":%d,\"f_cpu\":%d,\"stages\":{",
+         label, cosine, samples, scale_angle, b.loops, F_CPU);
+  for(int m = MARK_LOOP_START + 1; m < NUM_MARKS; m++)
+  {
+    print_stats(stage_names[m], &b.stage[m]);
+    if(m != NUM_MARKS - 1)
+      putchar(',');
+  }
+  printf("},");
+  print_stats("loop", &b.loop);
+  printf("}\n");
+
+  avr_terminate(b.avr);
+  free(b.steps);
+  return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs the firmware benchmark matrix under simavr and writes one JSON object
+# per configuration to $OUT (default bench/results/bench.jsonl).
+#
+#   ENVS     platformio bench envs to build (averaging flag matrix)
+#   COSINE   cosine_scaling_enable values to try
+#   SAMPLES  steering_num_samples values to try
+#   NOWHEELAVG_ENVS  envs built with WHEELAVG=0, where the sample count has no
+#            effect, so they only run once per COSINE value
+#   SCRIPT   optional stimulus script passed to mc2bench -s
+#   LOOPS    measured loops per run
+set -e
+
+cd "$(dirname "$0")/.."
+
+ENVS=${ENVS:-"bench bench_noavg bench_wheelavg bench_pedalavg"}
+COSINE=${COSINE:-"0 1"}
+SAMPLES=${SAMPLES:-"1 4 10 100"}
+NOWHEELAVG_ENVS=${NOWHEELAVG_ENVS:-"bench_noavg bench_pedalavg"}
+LOOPS=${LOOPS:-200}
+OUT=${OUT:-bench/results/bench.jsonl}
+
+make -C bench
+mkdir -p "$(dirname "$OUT")"
+: > "$OUT"
+
+for env in $ENVS; do
+  pio run -e "$env"
+  samples=$SAMPLES
+  case " $NOWHEELAVG_ENVS " in
+    *" $env "*) samples=10 ;;
+  esac
+  for cos in $COSINE; do
+    for n in $samples; do
+      bench/mc2bench -f ".pio/build/$env/firmware.elf" -t "$env" \
+        -c "$cos" -n "$n" -l "$LOOPS" ${SCRIPT:+-s "$SCRIPT"} >> "$OUT"
+    done
+  done
+done
+
+echo "results written to $OUT"
@@ -9,13 +9,43 @@
 #define DEBUG 0
 #define TIMEOUT_HALF_SECONDS 20
 #define ENABLESERIAL 1
+// the averaging flags can be overridden from platformio.ini build_flags (see the bench_* envs)
+#ifndef ACCELAVG
 #define ACCELAVG 1
+#endif
 #define ACCELSCALING 1
+#ifndef BRAKEAVG
 #define BRAKEAVG 1
+#endif
+#ifndef WHEELAVG
 #define WHEELAVG 1
+#endif
 #define COSINE_SCALING 1
 #define TIMESTUDY 0
 #define NUMLOOPS 100
+// BENCHMARK writes a stage marker to GPIOR0 at each step of loop() so the
+// simavr harness in bench/ can count cycles per stage. Each marker is an
+// ldi+out (2 cycles and a scratch register). The memory clobbers stop the
+// compiler moving work from one stage across the marker into the next.
+#ifndef BENCHMARK
+#define BENCHMARK 0
+#endif
+#if BENCHMARK
+#define BENCH_MARK(stage) do { asm volatile("" ::: "memory"); GPIOR0 = (stage); asm volatile("" ::: "memory"); } while(0)
+#else
+#define BENCH_MARK(stage)
+#endif
+#define BENCH_LOOP_START 1
+#define BENCH_ACCEL      2
+#define BENCH_BRAKE      3
+#define BENCH_WHEEL_ADC  4
+#define BENCH_COSINE     5
+#define BENCH_WHEEL_AVG  6
+#define BENCH_AXES       7
+#define BENCH_BUTTONS    8
+#define BENCH_DPAD       9
+#define BENCH_SEND      10
+#define BENCH_LOOP_END  11
 /*
 The 6 wheel buttons; Cross,Circle,Square,Triangle,L2,R2 have a resistance of 17kohm not pressed or ~5kohm pressed
 This causes intermittent detection when using digital IO.  Therefore, reassign those 6 buttons to use the 6 remaining
@@ -78,6 +108,10 @@ CAL           ORG/WHT(J5)
 #define STEERING_SCALE_ANGLE_DEFAULT 90
 #define STEERING_NUM_SAMPLES_DEFAULT 10
 #define STEERING_NUM_SAMPLES_MAX 100
+// Calibration profiles are stored back to back in EEPROM (profile 0 at address 0,
+// where the single calibration used to live) followed by the active profile number
+#define NUM_CAL_PROFILES 4
+#define PROFILE_NAME_LEN 10
 
 Joystick_ Joystick(JOYSTICK_DEFAULT_REPORT_ID,JOYSTICK_TYPE_GAMEPAD,
   MAX_NUM_BUTTONS, 4,                  // Button Count, Hat Switch Count
@@ -104,7 +138,25 @@ int brake_max = BRAKE_MAX_DEFAULT;
 int scale_angle = STEERING_SCALE_ANGLE_DEFAULT;
 int steering_num_samples = STEERING_NUM_SAMPLES_DEFAULT;
 bool cosine_scaling_enable = true;
+char name[PROFILE_NAME_LEN] = "";
 } wheelcal;
+#define EEPROM_ACTIVE_PROFILE_ADDR (NUM_CAL_PROFILES*sizeof(caltype))
+
+// Values cosine_scaling() needs that only change with the calibration,
+// precomputed so the loop doesn't do the float divisions every scan
+struct calderived
+{
+float bottom_range;
+float top_range;
+float scale_rad;
+float bottom_rad_per_count;
+float top_rad_per_count;
+} wheelderived;
+
+// RAM copies of every profile, loaded at boot so switching never touches EEPROM
+caltype calprofiles[NUM_CAL_PROFILES];
+calderived profilederived[NUM_CAL_PROFILES];
+uint8_t active_profile = 0;
 
 int _dpad_switch[4]={DUP,DRT,DDN,DLT};
 int lastButtonState[4] = {0,0,0,0};
@@ -179,11 +231,16 @@ void read_buttons()
 void show_menu()
 {
   Serial.println(F("\n    Calibration menu"));
+  Serial.print(F("Editing profile "));
+  Serial.print(active_profile+1);
+  Serial.print(F(": "));
+  Serial.println(wheelcal.name);
   Serial.println(F("1. Steering wheel min/max/center"));
   Serial.println(F("2. Accelerator min/max"));
   Serial.println(F("3. Brake min/max"));
   Serial.println(F("4. Steering wheel scaling"));
   Serial.println(F("5. Reset all values to defaults"));
+  Serial.println(F("6. Rename this profile"));
   Serial.println(F("0. quit cal mode and save values to EEPROM"));
   Serial.println(F("q. Quit and do not save\n"));
   Serial.print(F("You have "));
@@ -254,21 +311,46 @@ void steering_scale_angle()
   Serial.println(wheelcal.cosine_scaling_enable);
 }
 
+void rename_profile()
+{
+  String name_new;
+
+  Serial.setTimeout(10*1000);
+  Serial.print(F("Enter a name for this profile (up to "));
+  Serial.print(PROFILE_NAME_LEN-1);
+  Serial.println(F(" characters)"));
+  Serial.print(F("Current name: "));
+  Serial.println(wheelcal.name);
+  name_new = Serial.readStringUntil('\n');
+  name_new.trim();
+  if(name_new.length()>0)
+    name_new.toCharArray(wheelcal.name,PROFILE_NAME_LEN);
+  Serial.print(F("\n******************\nname = "));
+  Serial.println(wheelcal.name);
+}
+
+void calc_derived(const caltype &cal, calderived &derived)
+{
+  derived.bottom_range = cal.steering_center-cal.steering_left;
+  derived.top_range = cal.steering_right-cal.steering_center;
+  derived.scale_rad = cal.scale_angle*PI/180;
+  derived.bottom_rad_per_count = derived.bottom_range>0 ? derived.scale_rad/derived.bottom_range : 0;
+  derived.top_rad_per_count = derived.top_range>0 ? derived.scale_rad/derived.top_range : 0;
+}
+
 int cosine_scaling(int input_val)
 {
   float input_angle,cos_val;
-  float bottom_range, top_range;
   if(input_val<=wheelcal.steering_center) // we are between min and center
   {
-    // input_angle = wheelcal.scale_angle*input_val/(Center-Min)-wheelcal.scale_angle
-    bottom_range = wheelcal.steering_center-wheelcal.steering_left;
-    input_angle = wheelcal.scale_angle*float(input_val)/bottom_range-wheelcal.scale_angle;
-    cos_val = cos(input_angle*PI/180)*(bottom_range);
+    // input_angle = wheelcal.scale_angle*input_val/(Center-Min)-wheelcal.scale_angle (in radians)
+    input_angle = float(input_val)*wheelderived.bottom_rad_per_count-wheelderived.scale_rad;
+    cos_val = cos(input_angle)*wheelderived.bottom_range;
     #if DEBUG
     Serial.print(F(" input_val = "));
     Serial.print(input_val,DEC);
     Serial.print(F(" bottom_range = "));
-    Serial.print(bottom_range,DEC);
+    Serial.print(wheelderived.bottom_range,DEC);
     Serial.print(F(" input_angle = "));
     Serial.print(input_angle,DEC);
     Serial.print(F(" cos_val = "));
@@ -281,14 +363,13 @@ int cosine_scaling(int input_val)
     // input_angle = wheelcal.scale_angle*(input_val-Center)/(Max-Center)
     // Cos_ratio_high = 1-COS(Input_Angle*PI()/180)
     // cos_val = Cos_ratio_high*(Max-Center)+Center
-    top_range = wheelcal.steering_right-wheelcal.steering_center;
-    input_angle = float(input_val-wheelcal.steering_center)*wheelcal.scale_angle/top_range;
-    cos_val = ((1-cos(input_angle*PI/180))*top_range) + wheelcal.steering_center;
+    input_angle = float(input_val-wheelcal.steering_center)*wheelderived.top_rad_per_count;
+    cos_val = ((1-cos(input_angle))*wheelderived.top_range) + wheelcal.steering_center;
     #if DEBUG
     Serial.print(F(" input_val = "));
     Serial.print(input_val,DEC);
     Serial.print(F(" top_range = "));
-    Serial.print(top_range,DEC);
+    Serial.print(wheelderived.top_range,DEC);
     Serial.print(F(" input_angle = "));
     Serial.print(input_angle,DEC);
     Serial.print(F(" cos_val = "));
@@ -335,11 +416,12 @@ void brake_cal()
   while(!Serial.available()) delay(500);
 }
 
-void read_cal()
+void read_profile(uint8_t profile, caltype &cal)
 {
   // read the values out of EEPROM
   caltype temp_cal;
-  EEPROM.get(0,temp_cal);
+  EEPROM.get(profile*sizeof(caltype),temp_cal);
+  cal = caltype();
   // range check each setting. Only update the ones containing valid values
   #define ONE_THIRD_RANGE 341
   #define TWO_THIRD_RANGE 682
@@ -347,38 +429,78 @@ void read_cal()
   #define ONE_TENTH_RANGE 100
 
   if(temp_cal.steering_left>=0 && temp_cal.steering_left<=(ONE_THIRD_RANGE))
-    wheelcal.steering_left = temp_cal.steering_left;
+    cal.steering_left = temp_cal.steering_left;
   if(temp_cal.steering_right>=TWO_THIRD_RANGE && temp_cal.steering_right<=FULL_RANGE)
-    wheelcal.steering_right = temp_cal.steering_right;
+    cal.steering_right = temp_cal.steering_right;
   if(temp_cal.steering_center>=ONE_THIRD_RANGE && temp_cal.steering_center<=TWO_THIRD_RANGE)
-    wheelcal.steering_center = temp_cal.steering_center;
+    cal.steering_center = temp_cal.steering_center;
   if(temp_cal.scale_angle>=45 && temp_cal.scale_angle<=90)
-    wheelcal.scale_angle = temp_cal.scale_angle;
+    cal.scale_angle = temp_cal.scale_angle;
   if(temp_cal.steering_db>=0 && temp_cal.steering_db<=ONE_TENTH_RANGE)
-    wheelcal.steering_db = temp_cal.steering_db;
-  if(temp_cal.steering_num_samples>=0 && temp_cal.steering_num_samples<=STEERING_NUM_SAMPLES_MAX)
-    wheelcal.steering_num_samples = temp_cal.steering_num_samples;
-  wheelcal.cosine_scaling_enable = temp_cal.cosine_scaling_enable;
+    cal.steering_db = temp_cal.steering_db;
+  if(temp_cal.steering_num_samples>=1 && temp_cal.steering_num_samples<=STEERING_NUM_SAMPLES_MAX)
+    cal.steering_num_samples = temp_cal.steering_num_samples;
+  // read the flag as a raw byte: blank EEPROM is 0xFF, which isn't a valid bool
+  uint8_t cosine_byte = EEPROM.read(profile*sizeof(caltype)+offsetof(caltype,cosine_scaling_enable));
+  if(cosine_byte<=1)
+    cal.cosine_scaling_enable = cosine_byte;
   if(temp_cal.accel_min>=0 && temp_cal.accel_min<=ONE_THIRD_RANGE)
-    wheelcal.accel_min = temp_cal.accel_min;
+    cal.accel_min = temp_cal.accel_min;
   if(temp_cal.accel_max>=TWO_THIRD_RANGE && temp_cal.accel_max<=FULL_RANGE)
-    wheelcal.accel_max = temp_cal.accel_max;
+    cal.accel_max = temp_cal.accel_max;
 
   if(temp_cal.brake_min>=0 && temp_cal.brake_min<=ONE_THIRD_RANGE)
-    wheelcal.brake_min = temp_cal.brake_min;
+    cal.brake_min = temp_cal.brake_min;
   if(temp_cal.brake_max>=TWO_THIRD_RANGE && temp_cal.brake_max<=FULL_RANGE)
-    wheelcal.brake_max = temp_cal.brake_max;
+    cal.brake_max = temp_cal.brake_max;
+
+  // a blank EEPROM reads back 0xFF, so only keep a printable, terminated name
+  bool name_ok = temp_cal.name[0]!=0;
+  for(int c = 0; c < PROFILE_NAME_LEN && temp_cal.name[c]; c++)
+    name_ok &= isprint((unsigned char)temp_cal.name[c]) && c < PROFILE_NAME_LEN-1;
+  if(name_ok)
+    strcpy(cal.name,temp_cal.name);
+  else
+    snprintf(cal.name,PROFILE_NAME_LEN,"Profile%d",profile+1);
+}
+
+void read_cal()
+{
+  for(uint8_t p = 0; p < NUM_CAL_PROFILES; p++)
+  {
+    read_profile(p,calprofiles[p]);
+    calc_derived(calprofiles[p],profilederived[p]);
+  }
+  active_profile = EEPROM.read(EEPROM_ACTIVE_PROFILE_ADDR);
+  if(active_profile>=NUM_CAL_PROFILES)
+    active_profile = 0;
+  wheelcal = calprofiles[active_profile];
+  wheelderived = profilederived[active_profile];
+}
+
+void apply_cal()
+{
+  Joystick.setAcceleratorRange(wheelcal.accel_min,wheelcal.accel_max);
+  Joystick.setBrakeRange(wheelcal.brake_min,wheelcal.brake_max);
+  Joystick.setSteeringRange(wheelcal.steering_left,wheelcal.steering_right);
 }
 
 void save_cal()
 {
-  // save current values to EEPROM
-  EEPROM.put(0,wheelcal);
+  // save current values to the active profile in RAM and EEPROM
+  calprofiles[active_profile] = wheelcal;
+  calc_derived(wheelcal,profilederived[active_profile]);
+  EEPROM.put(active_profile*sizeof(caltype),wheelcal);
+  EEPROM.update(EEPROM_ACTIVE_PROFILE_ADDR,active_profile);
 }
 
 void print_cal()
 {
   Serial.println(F("\nCurrent calibration values:"));
+  Serial.print(F("profile = "));
+  Serial.print(active_profile+1);
+  Serial.print(F(" "));
+  Serial.println(wheelcal.name);
   Serial.print(F("steering_left = "));
   Serial.println(wheelcal.steering_left);
   Serial.print(F("steering_right = "));
@@ -402,6 +524,24 @@ void print_cal()
 
 }
 
+void list_profiles()
+{
+  Serial.println(F("\nCalibration profiles (START + right/left paddle for next/previous):"));
+  for(uint8_t p = 0; p < NUM_CAL_PROFILES; p++)
+  {
+    Serial.print(p==active_profile ? F("* ") : F("  "));
+    Serial.print(p+1);
+    Serial.print(F(" "));
+    Serial.print(calprofiles[p].name);
+    Serial.print(F("  scale_angle = "));
+    Serial.print(calprofiles[p].scale_angle);
+    Serial.print(F(", cosine_scaling_enable = "));
+    Serial.print(calprofiles[p].cosine_scaling_enable);
+    Serial.print(F(", steering_num_samples = "));
+    Serial.println(calprofiles[p].steering_num_samples);
+  }
+}
+
 void reset_cal()
 {
   wheelcal.steering_left = STEERING_LEFT_DEFAULT;
@@ -465,6 +605,9 @@ void do_analog_cal()
           case '5':
             reset_cal();
             break;
+          case '6':
+            rename_profile();
+            break;
           case '0':
             // save to EEPROM
             Serial.println(F("Done calibration. Saving values to EEPROM"));
@@ -472,13 +615,17 @@ void do_analog_cal()
             done = true;
             break;
           case 'q':
-            Serial.println(F("Exiting calibration mode.  Values NOT saved to EEPROM"));
+            Serial.println(F("Exiting calibration mode.  Values NOT saved, previous values restored"));
+            wheelcal = calprofiles[active_profile];
             done = true;
             break;
         }
       }
       else // timeout
-        Serial.println(F("\nTimeout.  Exiting calibration mode.  Values NOT saved to EEPROM"));
+      {
+        Serial.println(F("\nTimeout.  Exiting calibration mode.  Values NOT saved, previous values restored"));
+        wheelcal = calprofiles[active_profile];
+      }
 
       done |= timeout;
     }
@@ -514,9 +661,7 @@ void setup() {
     // apply calibration
     Serial.println(F("Applying calibration"));
   }
-  Joystick.setAcceleratorRange(wheelcal.accel_min,wheelcal.accel_max);
-  Joystick.setBrakeRange(wheelcal.brake_min,wheelcal.brake_max);
-  Joystick.setSteeringRange(wheelcal.steering_left,wheelcal.steering_right);
+  apply_cal();
 
 }
 
@@ -548,6 +693,75 @@ uint8_t i;
 unsigned long startmsec, elapsedmsec;
 int loopcounter=0;
 float accel_f;
+// START is held back from the report for up to START_HOLD_SCANS loops (~0.5s)
+// waiting for a paddle, so the game never sees the START half of a chord
+#define START_HOLD_SCANS 10
+bool lastPaddleL = false, lastPaddleR = false;
+bool chord_active = false;
+bool start_passed = false;
+int start_held_scans = 0;
+
+void select_profile(uint8_t profile)
+{
+  // RAM only so it can be called from loop(). EEPROM is only written by save_cal()
+  active_profile = profile;
+  wheelcal = calprofiles[profile];
+  wheelderived = profilederived[profile];
+  // restart the steering average from the current output so a different
+  // sample count doesn't average in stale entries
+  for( i = 0; i < wheelcal.steering_num_samples; i++ )
+    wheel_samples_buff[i] = _wheel;
+  num_wheel_samples = 0;
+  apply_cal();
+}
+
+void check_profile_chord()
+{
+  // START + right paddle = next profile, START + left paddle = previous profile
+  // START is not reported until it is released (then sent as a one loop press)
+  // or held alone for START_HOLD_SCANS. Once a paddle makes the chord, START and
+  // both paddles stay out of the report until all three are released.
+  bool paddleL = buttonState[0];
+  bool paddleR = buttonState[1];
+  bool start = buttonState[10];
+  bool start_tap = false;
+
+  if(start && !start_passed)
+  {
+    if(paddleR && !lastPaddleR)
+    {
+      select_profile((active_profile+1)%NUM_CAL_PROFILES);
+      chord_active = true;
+    }
+    else if(paddleL && !lastPaddleL)
+    {
+      select_profile((active_profile+NUM_CAL_PROFILES-1)%NUM_CAL_PROFILES);
+      chord_active = true;
+    }
+    else if(!chord_active && ++start_held_scans>=START_HOLD_SCANS)
+      start_passed = true;
+  }
+  else if(!start)
+  {
+    start_tap = !chord_active && start_held_scans>0 && !start_passed;
+    start_held_scans = 0;
+    start_passed = false;
+  }
+  if(chord_active && !start && !paddleL && !paddleR)
+    chord_active = false;
+
+  // read_buttons() already put the raw states in the report
+  if(chord_active)
+  {
+    Joystick.setButton(0,0);
+    Joystick.setButton(1,0);
+    Joystick.setButton(10,0);
+  }
+  else
+    Joystick.setButton(10,(start && start_passed) || start_tap);
+  lastPaddleL = paddleL;
+  lastPaddleR = paddleR;
+}
 
 void loop() 
 {
@@ -567,6 +781,7 @@ void loop()
     loopcounter = 0;
   }
   #endif
+  BENCH_MARK(BENCH_LOOP_START);
   raw_accel = analogRead(ACCEL);
   #if ACCELAVG
   accel_samples_buff[num_accel_samples++] = raw_accel;
@@ -584,6 +799,7 @@ void loop()
   accel_f = _accel;
   _accel = int(accel_f * accel_scaling_value);
   #endif
+  BENCH_MARK(BENCH_ACCEL);
 
   raw_brake = analogRead(BRAKE);
   #if BRAKEAVG
@@ -598,12 +814,15 @@ void loop()
   #else
   _brake = raw_brake;
   #endif
+  BENCH_MARK(BENCH_BRAKE);
 
   raw_wheel = analogRead(WHEEL);
+  BENCH_MARK(BENCH_WHEEL_ADC);
   if(wheelcal.cosine_scaling_enable)
     new_wheel = cosine_scaling(raw_wheel);
   else
     new_wheel = raw_wheel;
+  BENCH_MARK(BENCH_COSINE);
 
   #if WHEELAVG
   wheel_samples_buff[num_wheel_samples] = new_wheel;
@@ -616,25 +835,31 @@ void loop()
     _wheel_sum += wheel_samples_buff[i];
   _wheel = _wheel_sum / wheelcal.steering_num_samples;  
   #else
-  _wheel = raw_wheel;
+  _wheel = new_wheel;
   #endif
   #if DEADBAND
   // if wheel value is in the deadband (center +/- half of deadband), set it to wheelcal.steering_center
   if(_wheel>=(wheelcal.steering_center-wheelcal.steering_db/2) && _wheel<=(wheelcal.steering_center+wheelcal.steering_db/2))
     _wheel = wheelcal.steering_center;
   #endif
+  BENCH_MARK(BENCH_WHEEL_AVG);
 
   Joystick.setAccelerator(_accel);
   Joystick.setBrake(_brake);
   Joystick.setSteering(_wheel);
+  BENCH_MARK(BENCH_AXES);
 
   read_buttons();
+  check_profile_chord();
+  BENCH_MARK(BENCH_BUTTONS);
   read_DPAD();
+  BENCH_MARK(BENCH_DPAD);
 
   if (testAutoSendMode == false)
   {
     Joystick.sendState();
   }
+  BENCH_MARK(BENCH_SEND);
   #if ENABLESERIAL
   if(Serial.available())
   {
@@ -644,18 +869,27 @@ void loop()
         do_analog_cal();
         // apply calibration
         Serial.println(F("Applying calibration"));
-        Joystick.setAcceleratorRange(wheelcal.accel_min,wheelcal.accel_max);
-        Joystick.setBrakeRange(wheelcal.brake_min,wheelcal.brake_max);
-        Joystick.setSteeringRange(wheelcal.steering_left,wheelcal.steering_right);
+        calc_derived(wheelcal,wheelderived);
+        apply_cal();
         break;
       case 'p':
         print_cal();
         break;
+      case 'l':
+        list_profiles();
+        break;
+      case 'n':
+        select_profile((active_profile+1)%NUM_CAL_PROFILES);
+        Serial.print(F("Selected profile "));
+        Serial.print(active_profile+1);
+        Serial.print(F(" "));
+        Serial.println(wheelcal.name);
+        break;
       case 's':
         scanmode = !scanmode;
         break;
       case 'h':
-        Serial.println(F("c - calibrate\np - print cal values\ns - analog scan mode\nh - this help screen\na - about this software"));
+        Serial.println(F("c - calibrate\np - print cal values\nl - list profiles\nn - next profile\ns - analog scan mode\nh - this help screen\na - about this software"));
         break;
       case 'a':
         Serial.println(F("\nMadCatz MC2 USB Conversion Firmware\nfor Arduino Pro Micro (Atmega32U4)\nCopyright 2020 Cam Strandlund\n"));
@@ -687,10 +921,11 @@ void loop()
 
   }
   #endif
+  BENCH_MARK(BENCH_LOOP_END);
 
 #if DEBUG
   delay(500);
 #else
   delay(50);
 #endif
-}
\ No newline at end of file
+}
\ No newline at end of file